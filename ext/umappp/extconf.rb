@@ -19,6 +19,17 @@ abort "Numo header not found" unless find_header("numo/narray.h", numo)
 abort "Numo library not found" if Gem.win_platform? && !find_library("narray", nil, numo)
 find_header("numo.hpp", File.expand_path("../../include", __dir__))
 
+# SIMD kernels for the distance calculations and the calibration of the fuzzy
+# set membership strengths. They are compiled for all x86 instruction sets and
+# chosen at run time, so no -march flag is needed.
+# --disable-simd leaves them out, so that results do not depend on the CPU.
+$CXXFLAGS += " -DKNNCOLLE_MANUAL_VECTORIZATION -DUMAPPP_MANUAL_VECTORIZATION" if enable_config("simd", true)
+
+# Private methods that expose the distance kernels and the calibration of the
+# fuzzy set membership strengths to the tests. `rake compile` passes
+# --enable-test-hooks; installed gems are built without them.
+$CXXFLAGS += " -DUMAPPP_TEST_HOOKS" if enable_config("test-hooks", false)
+
 dir_config "umap", vendor, vendor
 dir_config "umappp", File.join(vendor, "umappp"), File.join(vendor, "umappp")
 
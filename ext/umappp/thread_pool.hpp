@@ -0,0 +1,230 @@
+// Persistent thread pool shared by all the parallel sections of umappp and
+// its dependencies (knncolle, kmeans, irlba). umappp.cpp binds their
+// *_CUSTOM_PARALLEL macros to the functions at the bottom of this file, so
+// that repeated calls to Umappp.run reuse the same threads instead of
+// starting new ones for every parallel region.
+//
+// A parallel region is split into chunks that are claimed from an atomic
+// counter, both by the calling thread and by up to `nthreads - 1` workers.
+// The chunks depend on `nthreads` only, not on the number of workers.
+// The caller always takes part, so a region completes even if every worker
+// is busy with other regions (e.g. from other Ruby threads) or if regions
+// are nested.
+
+#ifndef UMAPPP_RUBY_THREAD_POOL_HPP
+#define UMAPPP_RUBY_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+
+class ThreadPool
+{
+public:
+  // The pool is created on first use and never destroyed, so that worker
+  // threads do not have to be joined while Ruby is shutting down. A forked
+  // child has no worker threads, so it gets a pool of its own.
+  static ThreadPool &instance()
+  {
+    static std::mutex creation;
+    static ThreadPool *pool = nullptr;
+    std::lock_guard<std::mutex> lck(creation);
+    if (pool == nullptr || pool->pid_ != getpid())
+    {
+      pool = new ThreadPool(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    }
+    return *pool;
+  }
+
+  template <class Function>
+  void parallelize(size_t njobs, Function &fun, int nthreads)
+  {
+    if (njobs == 0)
+    {
+      return;
+    }
+
+    const size_t requested = static_cast<size_t>(std::max(nthreads, 1));
+    if (requested == 1 || njobs == 1)
+    {
+      fun(0, njobs);
+      return;
+    }
+
+    // A few chunks per thread so that a late worker does not hold up the
+    // others; callers may allocate workspaces per chunk, so not too many.
+    // The chunks only depend on the requested number of threads, not on the
+    // size of the pool, as some callers keep state per chunk (e.g. a random
+    // seed). If the pool is smaller, fewer threads share the same chunks.
+    Job job;
+    job.njobs = njobs;
+    job.nchunks = std::min(njobs, requested * 4);
+    job.max_helpers = std::min(requested, workers_ + 1) - 1;
+    job.context = &fun;
+    job.run = [](void *context, size_t first, size_t last) -> void {
+      (*static_cast<Function *>(context))(first, last);
+    };
+
+    {
+      std::lock_guard<std::mutex> lck(mut_);
+      queue_.push_back(&job);
+    }
+    for (size_t h = 0; h < job.max_helpers; ++h)
+    {
+      work_cv_.notify_one();
+    }
+
+    run_chunks(job);
+
+    {
+      std::unique_lock<std::mutex> lck(mut_);
+      remove(job);
+      job.done_cv.wait(lck, [&]() -> bool { return job.helpers == 0; });
+    }
+
+    if (job.error)
+    {
+      std::rethrow_exception(job.error);
+    }
+  }
+
+private:
+  struct Job
+  {
+    size_t njobs;
+    size_t nchunks;
+    size_t max_helpers;
+    void *context;
+    void (*run)(void *, size_t, size_t);
+
+    std::atomic<size_t> next{0};
+    size_t helpers = 0; // protected by the pool mutex.
+    std::condition_variable done_cv;
+    std::exception_ptr error;
+    std::mutex error_mut;
+  };
+
+  ThreadPool(size_t nworkers) : workers_(nworkers), pid_(getpid())
+  {
+    for (size_t w = 0; w < nworkers; ++w)
+    {
+      std::thread(&ThreadPool::loop, this).detach();
+    }
+  }
+
+  void run_chunks(Job &job)
+  {
+    while (true)
+    {
+      const size_t c = job.next.fetch_add(1);
+      if (c >= job.nchunks)
+      {
+        break;
+      }
+
+      // Same split as an OpenMP static schedule over the chunks.
+      const size_t per_chunk = job.njobs / job.nchunks, remainder = job.njobs % job.nchunks;
+      const size_t first = c * per_chunk + std::min(c, remainder);
+      const size_t last = first + per_chunk + (c < remainder);
+      try
+      {
+        job.run(job.context, first, last);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lck(job.error_mut);
+        if (!job.error)
+        {
+          job.error = std::current_exception();
+        }
+      }
+    }
+  }
+
+  void remove(Job &job)
+  {
+    auto it = std::find(queue_.begin(), queue_.end(), &job);
+    if (it != queue_.end())
+    {
+      queue_.erase(it);
+    }
+  }
+
+  // Returns a queued job that still has unclaimed chunks and room for
+  // another helper; exhausted jobs are dropped from the queue.
+  Job *claim()
+  {
+    for (auto it = queue_.begin(); it != queue_.end();)
+    {
+      Job *job = *it;
+      if (job->next.load() >= job->nchunks)
+      {
+        it = queue_.erase(it);
+      }
+      else if (job->helpers < job->max_helpers)
+      {
+        ++job->helpers;
+        return job;
+      }
+      else
+      {
+        ++it;
+      }
+    }
+    return nullptr;
+  }
+
+  void loop()
+  {
+    std::unique_lock<std::mutex> lck(mut_);
+    while (true)
+    {
+      Job *job = nullptr;
+      work_cv_.wait(lck, [&]() -> bool { return (job = claim()) != nullptr; });
+
+      lck.unlock();
+      run_chunks(*job);
+      lck.lock();
+
+      if (--job->helpers == 0)
+      {
+        job->done_cv.notify_one();
+      }
+    }
+  }
+
+  size_t workers_;
+  pid_t pid_;
+  std::mutex mut_;
+  std::condition_variable work_cv_;
+  std::deque<Job *> queue_;
+};
+
+// Signature of UMAPPP_CUSTOM_PARALLEL, KNNCOLLE_CUSTOM_PARALLEL and
+// KMEANS_CUSTOM_PARALLEL: `fun(first, last)` over [0, njobs).
+template <class Function>
+void thread_pool_parallelize(size_t njobs, Function fun, int nthreads)
+{
+  ThreadPool::instance().parallelize(njobs, fun, nthreads);
+}
+
+// Signature of IRLBA_CUSTOM_PARALLEL: `fun(t)` for each t in [0, nthreads).
+template <class Function>
+void thread_pool_parallelize_threads(int nthreads, Function fun)
+{
+  auto wrapper = [&](size_t first, size_t last) -> void {
+    for (size_t t = first; t < last; ++t)
+    {
+      fun(t);
+    }
+  };
+  ThreadPool::instance().parallelize(static_cast<size_t>(nthreads), wrapper, nthreads);
+}
+
+#endif
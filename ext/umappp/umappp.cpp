@@ -3,7 +3,22 @@
 
 #include <rice/rice.hpp>
 #include <rice/stl.hpp>
+#include <ruby/thread.h>
+#include <atomic>
+#include <exception>
+#include <fstream>
 #include "numo.hpp"
+
+// All parallel sections run on one persistent pool (see thread_pool.hpp).
+// These must be defined before any of the libraries are included.
+#include "thread_pool.hpp"
+#define UMAPPP_CUSTOM_PARALLEL thread_pool_parallelize
+#define KNNCOLLE_CUSTOM_PARALLEL thread_pool_parallelize
+#define KMEANS_CUSTOM_PARALLEL thread_pool_parallelize
+#define IRLBA_CUSTOM_PARALLEL thread_pool_parallelize_threads
+// Eigen would otherwise start its own OpenMP threads for the matrix products
+// of the GEMM index, on top of the pool threads that run the searches.
+#define EIGEN_DONT_PARALLELIZE
 #include "Umap.hpp"
 
 typedef float Float;
@@ -11,6 +26,99 @@ typedef typename umappp::Umap<Float> Umap;
 
 using namespace Rice;
 
+// Nearest neighbor methods, in the order of the list in lib/umappp.rb.
+
+enum NeighborMethod
+{
+  NN_NONE = -1,
+  NN_ANNOY = 0,
+  NN_VPTREE = 1,
+  NN_KMKNN = 2,
+  NN_HNSW = 3,
+  NN_BRUTE_FORCE = 4,
+  NN_GEMM = 5
+};
+
+// Saved sessions start with a magic string and a format version, followed by
+// the Umap parameters, the nearest neighbor method and all index parameters,
+// the number of columns of the data, the shape of the embedding, the
+// embedding itself, the optimizer state (fuzzy graph, sampling schedule, RNG)
+// and the index. Annoy and HNSW indices are written to a sidecar file,
+// `<path>.annoy` or `<path>.hnsw`; Annoy's is memory-mapped on load. All other
+// indices are written inline and read back without being rebuilt. All numbers
+// are in native byte order.
+//
+// Sessions saved by versions 1 and 2 are still read. They only hold the
+// search-time parameters of the index (plus, since version 2, whether VP
+// trees, brute-force and GEMM indices are single precision), and VP trees,
+// brute-force and GEMM indices are rebuilt from their data.
+
+const char session_magic[8] = {'U', 'M', 'A', 'P', 'P', 'P', 'R', 'B'};
+const uint32_t session_version = 3;
+
+std::string index_sidecar(const std::string &path, int nn_method)
+{
+  return path + (nn_method == NN_ANNOY ? ".annoy" : ".hnsw");
+}
+
+// Run `fun` without holding the GVL so that other Ruby threads keep running.
+// `fun` receives a flag that is raised when Ruby asks this thread to stop
+// (Thread#kill, Ctrl-C); long loops should poll it and return early.
+// Exceptions thrown by `fun` are re-raised after the GVL is reacquired.
+// Returns false if the call was cut short by an interrupt that Ruby decided
+// not to turn into an exception, so the caller can resume the work.
+// Ruby raises by longjmp, which would skip the destructors of the callers,
+// so everything that can raise runs under detail::protect. This turns the
+// jump into a C++ exception that Rice re-raises once the callers unwound.
+
+template <class Function>
+struct WithoutGvl
+{
+  Function &fun;
+  std::atomic<bool> interrupted;
+  std::exception_ptr error;
+
+  static void *call(void *ptr)
+  {
+    auto self = static_cast<WithoutGvl *>(ptr);
+    try
+    {
+      self->fun(self->interrupted);
+    }
+    catch (...)
+    {
+      self->error = std::current_exception();
+    }
+    return nullptr;
+  }
+
+  static void unblock(void *ptr)
+  {
+    static_cast<WithoutGvl *>(ptr)->interrupted.store(true);
+  }
+};
+
+template <class Function>
+bool without_gvl(Function fun)
+{
+  WithoutGvl<Function> payload{fun, {false}, nullptr};
+  void *data = &payload;
+  // Pending interrupts are serviced just before and after `call`.
+  detail::protect(rb_thread_call_without_gvl, &WithoutGvl<Function>::call, data,
+                  &WithoutGvl<Function>::unblock, data);
+  if (payload.error)
+  {
+    std::rethrow_exception(payload.error);
+  }
+  if (payload.interrupted.load())
+  {
+    // Raises if the interrupt was Thread#kill, Interrupt, etc.
+    detail::protect(rb_thread_check_ints);
+    return false;
+  }
+  return true;
+}
+
 // This function is used to view default parameters from Ruby.
 
 Hash umappp_default_parameters(Object self)
@@ -32,175 +140,1060 @@ Hash umappp_default_parameters(Object self)
   d[Symbol("seed")] = Umap::Defaults::seed;
   d[Symbol("num_threads")] = Umap::Defaults::num_threads;
   d[Symbol("parallel_optimization")] = Umap::Defaults::parallel_optimization;
+  d[Symbol("num_similarity_threads")] = Umap::Defaults::num_similarity_threads;
+  d[Symbol("newton_calibration")] = Umap::Defaults::newton_calibration;
+  d[Symbol("spin_budget")] = Umap::Defaults::spin_budget;
+  d[Symbol("ntrees")] = knncolle::AnnoyEuclidean<int, Float>::Defaults::ntrees;
+  d[Symbol("search_mult")] = knncolle::AnnoyEuclidean<int, Float>::Defaults::search_mult;
+  d[Symbol("nlinks")] = knncolle::HnswEuclidean<int, Float>::Defaults::nlinks;
+  d[Symbol("ef_construction")] = knncolle::HnswEuclidean<int, Float>::Defaults::ef_construction;
+  d[Symbol("ef_search")] = knncolle::HnswEuclidean<int, Float>::Defaults::ef_search;
+  d[Symbol("deterministic_build")] = knncolle::HnswEuclidean<int, Float>::Defaults::deterministic;
+  d[Symbol("power")] = knncolle::KmknnEuclidean<int, Float>::Defaults::power;
+  d[Symbol("bucket_size")] = knncolle::VpTreeEuclidean<int, Float>::Defaults::bucket_size;
+  d[Symbol("single_precision")] = false;
+  d[Symbol("max_block_memory")] = static_cast<long long>(knncolle::Gemm<int, Float>::Defaults::max_block_memory);
 
   return d;
 }
 
-// Function to perform umap.
+// The instruction set of the SIMD kernels, as an index into SIMD_LEVELS in
+// lib/umappp.rb. The kernels are chosen at run time from those supported by
+// the CPU, unless the extension was configured with --disable-simd.
 
-Object umappp_run(
-    Object self,
-    Hash params,
-    numo::SFloat data,
-    int ndim,
-    int nn_method)
+int umappp_simd_level(Object self)
 {
-  // Parameters are taken from a Ruby Hash object.
-  // If there is key, set the value.
-  if (ndim < 1)
+#ifdef KNNCOLLE_MANUAL_VECTORIZATION
+  return static_cast<int>(knncolle::simd_level());
+#else
+  return static_cast<int>(knncolle::SimdLevel::NONE);
+#endif
+}
+
+int umappp_supported_simd_level(Object self)
+{
+#ifdef KNNCOLLE_MANUAL_VECTORIZATION
+  return static_cast<int>(knncolle::supported_simd_level());
+#else
+  return static_cast<int>(knncolle::SimdLevel::NONE);
+#endif
+}
+
+void umappp_set_simd_level(Object self, int level)
+{
+  if (level > umappp_supported_simd_level(self) || !knncolle::set_simd_level(static_cast<knncolle::SimdLevel>(level)))
   {
-    throw std::runtime_error("ndim is less than 1");
+    throw std::runtime_error("the SIMD level is not supported");
   }
+}
 
-  std::unique_ptr<Umap> umap_ptr(new Umap);
+#ifdef UMAPPP_TEST_HOOKS
+// Squared Euclidean distances between the rows of `x` and the same rows of
+// `y`, computed like the nearest neighbor indices do. Used by the tests to
+// compare the SIMD kernels with the scalar code; only compiled with
+// --enable-test-hooks.
+
+template <typename Distance, typename Input>
+Object squared_distances(Input x, Input y)
+{
+  if (x.ndim() != 2 || y.ndim() != 2 || x.shape()[0] != y.shape()[0] || x.shape()[1] != y.shape()[1])
+  {
+    throw std::runtime_error("x and y must be 2D arrays of the same shape");
+  }
+  const size_t nobs = x.shape()[0];
+  const int nd = x.shape()[1];
+  auto xptr = x.read_ptr();
+  auto yptr = y.read_ptr();
+  VALUE x_value = x.value();
+  VALUE y_value = y.value();
+
+  numo::DFloat output({nobs});
+  double *optr = output.write_ptr();
+  for (size_t i = 0; i < nobs; ++i)
+  {
+    optr[i] = knncolle::distances::Euclidean::raw_distance<int, Distance>(xptr + i * nd, yptr + i * nd, nd);
+  }
+
+  RB_GC_GUARD(x_value);
+  RB_GC_GUARD(y_value);
+  return output;
+}
+
+Object umappp_squared_distances(Object self, Object x, Object y, bool single_precision)
+{
+  if (rb_obj_is_kind_of(x.value(), numo_cDFloat))
+  {
+    return squared_distances<double>(numo::DFloat(x), numo::DFloat(y));
+  }
+  else if (single_precision)
+  {
+    return squared_distances<float>(numo::SFloat(x), numo::SFloat(y));
+  }
+  else
+  {
+    return squared_distances<double>(numo::SFloat(x), numo::SFloat(y));
+  }
+}
+#endif
+
+#ifdef UMAPPP_TEST_HOOKS
+// Fuzzy set membership strengths for an n x k matrix of neighbor distances,
+// with the default local connectivity and bandwidth. Used by the tests to
+// compare Newton's method with bisection, with and without the SIMD kernels
+// (which are only used for single precision); only compiled with
+// --enable-test-hooks.
+
+template <typename Value, typename Input>
+Object neighbor_similarities(Input distances, bool newton)
+{
+  if (distances.ndim() != 2)
+  {
+    throw std::runtime_error("distances must be a 2D array");
+  }
+  const size_t nobs = distances.shape()[0];
+  const size_t k = distances.shape()[1];
+  auto dptr = distances.read_ptr();
+  VALUE distances_value = distances.value();
+
+  umappp::CompressedNeighborList<Value> x(nobs, nobs * k);
+  x.indices.resize(nobs * k);
+  x.values.assign(dptr, dptr + nobs * k);
+  for (size_t i = 0; i < nobs; ++i)
+  {
+    x.pointers[i + 1] = (i + 1) * k;
+  }
+  umappp::neighbor_similarities<Value>(x, 1, 1, 1, newton);
+
+  Input output({nobs, k});
+  std::copy(x.values.begin(), x.values.end(), output.write_ptr());
+
+  RB_GC_GUARD(distances_value);
+  return output;
+}
+
+Object umappp_neighbor_similarities(Object self, Object distances, bool newton)
+{
+  if (rb_obj_is_kind_of(distances.value(), numo_cDFloat))
+  {
+    return neighbor_similarities<double>(numo::DFloat(distances), newton);
+  }
+  else
+  {
+    return neighbor_similarities<float>(numo::SFloat(distances), newton);
+  }
+}
+#endif
+
+// Set the parameters of a Umap object from a Ruby Hash.
+// Parameters that are not in the Hash are left as they are.
+
+void umappp_configure(Umap &umap, Hash params)
+{
+  // Parameters are taken from a Ruby Hash object.
+  // If there is key, set the value.
 
   double local_connectivity = Umap::Defaults::local_connectivity;
   if (RTEST(params.call("has_key?", Symbol("local_connectivity"))))
   {
     local_connectivity = params.get<double>(Symbol("local_connectivity"));
-    umap_ptr->set_local_connectivity(local_connectivity);
+    umap.set_local_connectivity(local_connectivity);
   }
 
   double bandwidth = Umap::Defaults::bandwidth;
   if (RTEST(params.call("has_key?", Symbol("bandwidth"))))
   {
     bandwidth = params.get<double>(Symbol("bandwidth"));
-    umap_ptr->set_bandwidth(bandwidth);
+    umap.set_bandwidth(bandwidth);
   }
 
   double mix_ratio = Umap::Defaults::mix_ratio;
   if (RTEST(params.call("has_key?", Symbol("mix_ratio"))))
   {
     mix_ratio = params.get<double>(Symbol("mix_ratio"));
-    umap_ptr->set_mix_ratio(mix_ratio);
+    umap.set_mix_ratio(mix_ratio);
   }
 
   double spread = Umap::Defaults::spread;
   if (RTEST(params.call("has_key?", Symbol("spread"))))
   {
     spread = params.get<double>(Symbol("spread"));
-    umap_ptr->set_spread(spread);
+    umap.set_spread(spread);
   }
 
   double min_dist = Umap::Defaults::min_dist;
   if (RTEST(params.call("has_key?", Symbol("min_dist"))))
   {
     min_dist = params.get<double>(Symbol("min_dist"));
-    umap_ptr->set_min_dist(min_dist);
+    umap.set_min_dist(min_dist);
   }
 
   double a = Umap::Defaults::a;
   if (RTEST(params.call("has_key?", Symbol("a"))))
   {
     a = params.get<double>(Symbol("a"));
-    umap_ptr->set_a(a);
+    umap.set_a(a);
   }
 
   double b = Umap::Defaults::b;
   if (RTEST(params.call("has_key?", Symbol("b"))))
   {
     b = params.get<double>(Symbol("b"));
-    umap_ptr->set_b(b);
+    umap.set_b(b);
   }
 
   double repulsion_strength = Umap::Defaults::repulsion_strength;
   if (RTEST(params.call("has_key?", Symbol("repulsion_strength"))))
   {
     repulsion_strength = params.get<double>(Symbol("repulsion_strength"));
-    umap_ptr->set_repulsion_strength(repulsion_strength);
+    umap.set_repulsion_strength(repulsion_strength);
   }
 
   umappp::InitMethod initialize = Umap::Defaults::initialize;
   if (RTEST(params.call("has_key?", Symbol("initialize"))))
   {
     initialize = params.get<umappp::InitMethod>(Symbol("initialize"));
-    umap_ptr->set_initialize(initialize);
+    umap.set_initialize(initialize);
   }
 
   int num_epochs = Umap::Defaults::num_epochs;
   if (RTEST(params.call("has_key?", Symbol("num_epochs"))))
   {
     num_epochs = params.get<int>(Symbol("num_epochs"));
-    umap_ptr->set_num_epochs(num_epochs);
+    umap.set_num_epochs(num_epochs);
   }
 
   double learning_rate = Umap::Defaults::learning_rate;
   if (RTEST(params.call("has_key?", Symbol("learning_rate"))))
   {
     learning_rate = params.get<double>(Symbol("learning_rate"));
-    umap_ptr->set_learning_rate(learning_rate);
+    umap.set_learning_rate(learning_rate);
   }
 
   double negative_sample_rate = Umap::Defaults::negative_sample_rate;
   if (RTEST(params.call("has_key?", Symbol("negative_sample_rate"))))
   {
     negative_sample_rate = params.get<double>(Symbol("negative_sample_rate"));
-    umap_ptr->set_negative_sample_rate(negative_sample_rate);
+    umap.set_negative_sample_rate(negative_sample_rate);
   }
 
   int num_neighbors = Umap::Defaults::num_neighbors;
   if (RTEST(params.call("has_key?", Symbol("num_neighbors"))))
   {
     num_neighbors = params.get<int>(Symbol("num_neighbors"));
-    umap_ptr->set_num_neighbors(num_neighbors);
+    umap.set_num_neighbors(num_neighbors);
   }
 
   int seed = Umap::Defaults::seed;
   if (RTEST(params.call("has_key?", Symbol("seed"))))
   {
     seed = params.get<int>(Symbol("seed"));
-    umap_ptr->set_seed(seed);
+    umap.set_seed(seed);
   }
 
   int num_threads = Umap::Defaults::num_threads;
   if (RTEST(params.call("has_key?", Symbol("num_threads"))))
   {
     num_threads = params.get<int>(Symbol("num_threads"));
-    umap_ptr->set_num_threads(num_threads);
+    umap.set_num_threads(num_threads);
   }
 
   bool parallel_optimization = Umap::Defaults::parallel_optimization;
   if (RTEST(params.call("has_key?", Symbol("parallel_optimization"))))
   {
-    parallel_optimization = params.get<bool>(Symbol("parallel_optimization"));
-    umap_ptr->set_parallel_optimization(parallel_optimization);
+    // :async selects lock-free asynchronous updates, anything else is a boolean.
+    Object value = params.get<Object>(Symbol("parallel_optimization"));
+    bool asynchronous_optimization = value.is_equal(Symbol("async"));
+    parallel_optimization = asynchronous_optimization || value.test();
+    umap.set_parallel_optimization(parallel_optimization);
+    umap.set_asynchronous_optimization(asynchronous_optimization);
+  }
+
+  int num_similarity_threads = Umap::Defaults::num_similarity_threads;
+  if (RTEST(params.call("has_key?", Symbol("num_similarity_threads"))))
+  {
+    num_similarity_threads = params.get<int>(Symbol("num_similarity_threads"));
+    umap.set_num_similarity_threads(num_similarity_threads);
+  }
+
+  int spin_budget = Umap::Defaults::spin_budget;
+  if (RTEST(params.call("has_key?", Symbol("spin_budget"))))
+  {
+    spin_budget = params.get<int>(Symbol("spin_budget"));
+    umap.set_spin_budget(spin_budget);
+  }
+
+  bool newton_calibration = Umap::Defaults::newton_calibration;
+  if (RTEST(params.call("has_key?", Symbol("newton_calibration"))))
+  {
+    newton_calibration = params.get<bool>(Symbol("newton_calibration"));
+    umap.set_newton_calibration(newton_calibration);
+  }
+
+}
+
+// Create a Umap object from the parameters in a Ruby Hash.
+
+std::unique_ptr<Umap> umappp_new(Hash params)
+{
+  std::unique_ptr<Umap> umap_ptr(new Umap);
+  umappp_configure(*umap_ptr, params);
+  return umap_ptr;
+}
+
+// Parameters of the nearest neighbor index, which are given in the same
+// Ruby Hash as the Umap parameters.
+
+struct IndexParameters
+{
+  // Annoy
+  int ntrees = knncolle::AnnoyEuclidean<int, Float>::Defaults::ntrees;
+  double search_mult = knncolle::AnnoyEuclidean<int, Float>::Defaults::search_mult;
+  // HNSW
+  int nlinks = knncolle::HnswEuclidean<int, Float>::Defaults::nlinks;
+  int ef_construction = knncolle::HnswEuclidean<int, Float>::Defaults::ef_construction;
+  int ef_search = knncolle::HnswEuclidean<int, Float>::Defaults::ef_search;
+  bool deterministic_build = knncolle::HnswEuclidean<int, Float>::Defaults::deterministic;
+  // Kmknn
+  double power = knncolle::KmknnEuclidean<int, Float>::Defaults::power;
+  // VP tree
+  int bucket_size = knncolle::VpTreeEuclidean<int, Float>::Defaults::bucket_size;
+  // VP tree, brute force and GEMM: store the data and compute distances in
+  // Float instead of double.
+  bool single_precision = false;
+  // GEMM
+  size_t max_block_memory = knncolle::Gemm<int, Float>::Defaults::max_block_memory;
+
+  int num_threads = Umap::Defaults::num_threads;
+};
+
+// Set the index parameters from a Ruby Hash.
+// Parameters that are not in the Hash are left as they are.
+
+void umappp_configure_index(IndexParameters &index, Hash params)
+{
+  if (RTEST(params.call("has_key?", Symbol("ntrees"))))
+  {
+    index.ntrees = params.get<int>(Symbol("ntrees"));
   }
 
-  // initialize_from_matrix
+  if (RTEST(params.call("has_key?", Symbol("search_mult"))))
+  {
+    index.search_mult = params.get<double>(Symbol("search_mult"));
+  }
 
-  const float *y = data.read_ptr();
-  size_t *shape = data.shape();
+  if (RTEST(params.call("has_key?", Symbol("nlinks"))))
+  {
+    index.nlinks = params.get<int>(Symbol("nlinks"));
+  }
 
-  int nd = shape[1];
-  int nobs = shape[0];
-  if (nobs < 0)
+  if (RTEST(params.call("has_key?", Symbol("ef_construction"))))
   {
-    throw std::runtime_error("nobs is negative");
+    index.ef_construction = params.get<int>(Symbol("ef_construction"));
   }
 
-  std::unique_ptr<knncolle::Base<int, Float>> knncolle_ptr;
-  if (nn_method == 0)
+  if (RTEST(params.call("has_key?", Symbol("ef_search"))))
   {
-    knncolle_ptr.reset(new knncolle::AnnoyEuclidean<int, Float>(nd, nobs, y));
+    index.ef_search = params.get<int>(Symbol("ef_search"));
   }
-  else if (nn_method == 1)
+
+  if (RTEST(params.call("has_key?", Symbol("deterministic_build"))))
   {
-    knncolle_ptr.reset(new knncolle::KmknnEuclidean<int, Float>(nd, nobs, y));
+    index.deterministic_build = params.get<bool>(Symbol("deterministic_build"));
   }
 
-  std::vector<Float> embedding(ndim * nobs);
+  if (RTEST(params.call("has_key?", Symbol("power"))))
+  {
+    index.power = params.get<double>(Symbol("power"));
+  }
 
-  auto status = umap_ptr->initialize(knncolle_ptr.get(), ndim, embedding.data());
+  if (RTEST(params.call("has_key?", Symbol("bucket_size"))))
+  {
+    index.bucket_size = params.get<int>(Symbol("bucket_size"));
+  }
 
-  int epoch_limit = 0;
-  // tick is not implemented yet
-  status.run(epoch_limit);
+  if (RTEST(params.call("has_key?", Symbol("single_precision"))))
+  {
+    index.single_precision = params.get<bool>(Symbol("single_precision"));
+  }
 
-  // it is safe to cast to unsigned int
-  auto na = numo::SFloat({(unsigned int)nobs, (unsigned int)ndim});
-  std::copy(embedding.begin(), embedding.end(), na.write_ptr());
+  if (RTEST(params.call("has_key?", Symbol("max_block_memory"))))
+  {
+    const long long max_block_memory = params.get<long long>(Symbol("max_block_memory"));
+    // Less than one distance per block would be rounded up by Gemm, and a
+    // negative value would wrap around to an enormous block.
+    if (max_block_memory < static_cast<long long>(sizeof(Float)))
+    {
+      throw std::runtime_error("max_block_memory is less than the size of one distance");
+    }
+    index.max_block_memory = max_block_memory;
+  }
 
-  return na;
+  if (RTEST(params.call("has_key?", Symbol("num_threads"))))
+  {
+    index.num_threads = params.get<int>(Symbol("num_threads"));
+  }
+}
+
+// Write all index parameters to a saved session (since version 3).
+
+void umappp_save_index_parameters(std::ostream &out, const IndexParameters &index)
+{
+  knncolle::write_scalar<int32_t>(out, index.ntrees);
+  knncolle::write_scalar<double>(out, index.search_mult);
+  knncolle::write_scalar<int32_t>(out, index.nlinks);
+  knncolle::write_scalar<int32_t>(out, index.ef_construction);
+  knncolle::write_scalar<int32_t>(out, index.ef_search);
+  knncolle::write_scalar<uint8_t>(out, index.deterministic_build);
+  knncolle::write_scalar<double>(out, index.power);
+  knncolle::write_scalar<int32_t>(out, index.bucket_size);
+  knncolle::write_scalar<uint8_t>(out, index.single_precision);
+  knncolle::write_scalar<uint64_t>(out, index.max_block_memory);
+  knncolle::write_scalar<int32_t>(out, index.num_threads);
+}
+
+void umappp_load_index_parameters(std::istream &in, IndexParameters &index)
+{
+  index.ntrees = knncolle::read_scalar<int32_t>(in);
+  index.search_mult = knncolle::read_scalar<double>(in);
+  index.nlinks = knncolle::read_scalar<int32_t>(in);
+  index.ef_construction = knncolle::read_scalar<int32_t>(in);
+  index.ef_search = knncolle::read_scalar<int32_t>(in);
+  index.deterministic_build = knncolle::read_scalar<uint8_t>(in) != 0;
+  index.power = knncolle::read_scalar<double>(in);
+  index.bucket_size = knncolle::read_scalar<int32_t>(in);
+  index.single_precision = knncolle::read_scalar<uint8_t>(in) != 0;
+  index.max_block_memory = knncolle::read_scalar<uint64_t>(in);
+  index.num_threads = knncolle::read_scalar<int32_t>(in);
+}
+
+// A UMAP run that can be advanced a few epochs at a time.
+// The embedding lives in a Numo::SFloat owned by the session, so Ruby can
+// look at the current coordinates without copying them.
+
+class UmapSession
+{
+public:
+  UmapSession(Hash params, Object data, int ndim, int nn_method)
+  {
+    if (ndim < 1)
+    {
+      throw std::runtime_error("ndim is less than 1");
+    }
+
+    umap_ = umappp_new(params);
+    umappp_configure_index(index_params_, params);
+
+    // initialize_from_matrix
+
+    // Numo::SFloat and Numo::DFloat are read in place; the casts below
+    // return the same object when the class already matches, and only
+    // non-contiguous views are duplicated by read_ptr().
+    if (rb_obj_is_kind_of(data.value(), numo_cDFloat))
+    {
+      numo::DFloat x(data);
+      const double *y = x.read_ptr();
+      VALUE x_value = x.value();
+      initialize(*umap_, y, x.shape(), ndim, nn_method);
+      RB_GC_GUARD(x_value);
+    }
+    else
+    {
+      numo::SFloat x(data);
+      const float *y = x.read_ptr();
+      VALUE x_value = x.value();
+      initialize(*umap_, y, x.shape(), ndim, nn_method);
+      RB_GC_GUARD(x_value);
+    }
+  }
+
+  // Start from precomputed neighbors, given as nobs x k matrices of
+  // neighbor indices and distances (e.g. from FAISS). Negative indices
+  // (missing neighbors) and the observation itself are skipped.
+  UmapSession(Hash params, numo::Int32 indices, numo::SFloat distances, int ndim)
+  {
+    if (ndim < 1)
+    {
+      throw std::runtime_error("ndim is less than 1");
+    }
+
+    umap_ = umappp_new(params);
+
+    if (indices.ndim() != 2 || distances.ndim() != 2)
+    {
+      throw std::runtime_error("indices and distances must be 2D arrays");
+    }
+    size_t *shape = indices.shape();
+    size_t *dshape = distances.shape();
+    if (shape[0] != dshape[0] || shape[1] != dshape[1])
+    {
+      throw std::runtime_error("indices and distances must have the same shape");
+    }
+
+    const int32_t *idx = indices.read_ptr();
+    const float *dist = distances.read_ptr();
+    VALUE indices_value = indices.value();
+    VALUE distances_value = distances.value();
+
+    int nobs = shape[0];
+    int k = shape[1];
+
+    auto na = numo::SFloat({(unsigned int)nobs, (unsigned int)ndim});
+    Float *embedding = na.write_ptr();
+    embedding_ = na.value();
+
+    without_gvl([&](const std::atomic<bool> &) {
+      umappp::CompressedNeighborList<Float> x(nobs, static_cast<size_t>(nobs) * k);
+      std::vector<std::pair<Float, int>> current;
+      current.reserve(k);
+      for (int i = 0; i < nobs; ++i)
+      {
+        const int32_t *iptr = idx + static_cast<size_t>(i) * k;
+        const float *dptr = dist + static_cast<size_t>(i) * k;
+        current.clear();
+        for (int j = 0; j < k; ++j)
+        {
+          if (iptr[j] < 0 || iptr[j] == i)
+          {
+            continue;
+          }
+          if (iptr[j] >= nobs)
+          {
+            throw std::runtime_error("neighbor index is out of range");
+          }
+          current.emplace_back(dptr[j], iptr[j]);
+        }
+
+        // The similarity calculations expect increasing distances.
+        auto by_distance = [](const std::pair<Float, int> &l, const std::pair<Float, int> &r) -> bool {
+          return l.first < r.first;
+        };
+        if (!std::is_sorted(current.begin(), current.end(), by_distance))
+        {
+          std::stable_sort(current.begin(), current.end(), by_distance);
+        }
+
+        for (const auto &c : current)
+        {
+          x.indices.push_back(c.second);
+          x.values.push_back(c.first);
+        }
+        x.pointers[i + 1] = x.indices.size();
+      }
+
+      status_.reset(new Umap::Status(umap_->initialize(std::move(x), ndim, embedding)));
+      epoch_.store(status_->epoch());
+    });
+
+    RB_GC_GUARD(indices_value);
+    RB_GC_GUARD(distances_value);
+  }
+
+  // Restore a session written by save(). Parameters in `params` override
+  // the saved ones, e.g. to use a different number of threads.
+  UmapSession(const std::string &path, Hash params)
+  {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+      throw std::runtime_error("cannot open " + path);
+    }
+
+    char magic[sizeof(session_magic)];
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), session_magic))
+    {
+      throw std::runtime_error(path + " is not a saved umappp session");
+    }
+    const uint32_t version = knncolle::read_scalar<uint32_t>(in);
+    if (version < 1 || version > session_version)
+    {
+      throw std::runtime_error(path + " was saved by an incompatible version of umappp");
+    }
+
+    umap_.reset(new Umap);
+    umap_->load(in);
+    umappp_configure(*umap_, params);
+
+    nn_method_ = knncolle::read_scalar<int32_t>(in);
+    if (version >= 3)
+    {
+      umappp_load_index_parameters(in, index_params_);
+    }
+    else
+    {
+      index_params_.search_mult = knncolle::read_scalar<double>(in);
+      index_params_.ef_search = knncolle::read_scalar<int32_t>(in);
+      if (version >= 2)
+      {
+        index_params_.single_precision = knncolle::read_scalar<uint8_t>(in) != 0;
+      }
+    }
+    const IndexParameters saved = index_params_;
+    umappp_configure_index(index_params_, params);
+    if (version >= 3)
+    {
+      // The index is read as it was built, so only the parameters of the
+      // search can be changed.
+      index_params_.ntrees = saved.ntrees;
+      index_params_.nlinks = saved.nlinks;
+      index_params_.ef_construction = saved.ef_construction;
+      index_params_.deterministic_build = saved.deterministic_build;
+      index_params_.power = saved.power;
+      index_params_.bucket_size = saved.bucket_size;
+      index_params_.single_precision = saved.single_precision;
+    }
+    const int nd = knncolle::read_scalar<int32_t>(in);
+    const int nobs = knncolle::read_scalar<int32_t>(in);
+    const int ndim = knncolle::read_scalar<int32_t>(in);
+    if (nobs < 0 || ndim < 1)
+    {
+      throw std::runtime_error("invalid embedding shape in " + path);
+    }
+
+    auto na = numo::SFloat({(unsigned int)nobs, (unsigned int)ndim});
+    Float *embedding = na.write_ptr();
+    embedding_ = na.value();
+
+    without_gvl([&](const std::atomic<bool> &) {
+      knncolle::read_array(in, embedding, static_cast<size_t>(nobs) * ndim);
+      status_.reset(new Umap::Status(umap_->load_status(in, ndim, embedding)));
+      epoch_.store(status_->epoch());
+      if (status_->nobs() != static_cast<size_t>(nobs))
+      {
+        throw std::runtime_error("inconsistent number of observations in " + path);
+      }
+
+      if (nn_method_ == NN_ANNOY)
+      {
+        searcher_.reset(new knncolle::AnnoyEuclidean<int, Float>(index_sidecar(path, nn_method_), nd, index_params_.search_mult));
+      }
+      else if (nn_method_ == NN_HNSW)
+      {
+        searcher_.reset(new knncolle::HnswEuclidean<int, Float>(index_sidecar(path, nn_method_), nd, index_params_.ef_search));
+      }
+      else if (nn_method_ == NN_KMKNN || (version >= 3 && (nn_method_ == NN_VPTREE || nn_method_ == NN_BRUTE_FORCE || nn_method_ == NN_GEMM)))
+      {
+        searcher_ = load_index(in, nn_method_);
+      }
+      else if (nn_method_ == NN_VPTREE || nn_method_ == NN_BRUTE_FORCE || nn_method_ == NN_GEMM)
+      {
+        // Versions 1 and 2 only saved the data of these indices.
+        auto data = knncolle::read_vector<Float>(in);
+        if (data.size() != static_cast<size_t>(nobs) * nd)
+        {
+          throw std::runtime_error("inconsistent data in " + path);
+        }
+        searcher_ = build_index(nn_method_, nd, nobs, data.data());
+      }
+      else if (nn_method_ != NN_NONE)
+      {
+        throw std::runtime_error("unknown nearest neighbor method in " + path);
+      }
+      if (searcher_ && (searcher_->nobs() != nobs || searcher_->ndim() != nd))
+      {
+        throw std::runtime_error("the nearest neighbor index does not match the embedding in " + path);
+      }
+    });
+  }
+
+  // Read without the Busy guard, so that another thread can follow the
+  // progress of a session while it is being stepped.
+  int epoch() const
+  {
+    return epoch_.load();
+  }
+
+  int num_epochs() const
+  {
+    return status_->num_epochs();
+  }
+
+  bool is_finished() const
+  {
+    return epoch() >= num_epochs();
+  }
+
+  // Run up to `epochs` more epochs, stopping at the total number of epochs.
+  // The optimizer polls the interrupt flag between epochs, so interrupts are
+  // noticed without leaving it after every epoch.
+  int step(int epochs)
+  {
+    if (epochs < 0)
+    {
+      throw std::runtime_error("epochs is negative");
+    }
+
+    Busy busy(busy_);
+    int limit = std::min(num_epochs(), status_->epoch() + epochs);
+    bool finished = false;
+    while (!finished)
+    {
+      finished = without_gvl([&](const std::atomic<bool> &interrupted) {
+        if (status_->epoch() < limit)
+        {
+          status_->run(limit, &interrupted);
+        }
+        epoch_.store(status_->epoch());
+      });
+    }
+
+    return epoch();
+  }
+
+  Object run()
+  {
+    step(num_epochs() - epoch());
+    return embedding();
+  }
+
+  Object embedding() const
+  {
+    return Object(embedding_);
+  }
+
+  // Place new observations into the current embedding, using the index
+  // built for this session. The session's embedding is not modified.
+  Object transform(numo::SFloat data, int num_epochs)
+  {
+    if (!searcher_)
+    {
+      throw std::runtime_error("transform requires a session created from data");
+    }
+    Busy busy(busy_);
+    if (data.ndim() != 2)
+    {
+      throw std::runtime_error("data must be a 2D array");
+    }
+    size_t *shape = data.shape();
+    if (static_cast<int>(shape[1]) != searcher_->ndim())
+    {
+      throw std::runtime_error("data must have the same number of columns as the training data");
+    }
+
+    const float *query = data.read_ptr();
+    VALUE data_value = data.value();
+    const int ndim = status_->ndim();
+    size_t nquery = shape[0];
+
+    auto na = numo::SFloat({(unsigned int)nquery, (unsigned int)ndim});
+    Float *output = na.write_ptr();
+    VALUE output_value = na.value();
+    const Float *reference = status_->embedding();
+
+    without_gvl([&](const std::atomic<bool> &) {
+      umap_->transform(searcher_.get(), nquery, query, ndim, reference, output, num_epochs);
+    });
+
+    RB_GC_GUARD(data_value);
+    RB_GC_GUARD(output_value);
+    return na;
+  }
+
+  // Write the session to `path` (and `path.annoy` or `path.hnsw` for Annoy
+  // and HNSW indices), so that it can be restored in another process without
+  // redoing the neighbor search or the optimization.
+  void save(const std::string &path)
+  {
+    Busy busy(busy_);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+      throw std::runtime_error("cannot open " + path);
+    }
+
+    const int nd = searcher_ ? searcher_->ndim() : 0;
+    const int nobs = status_->nobs();
+    const int ndim = status_->ndim();
+
+    without_gvl([&](const std::atomic<bool> &) {
+      out.write(session_magic, sizeof(session_magic));
+      knncolle::write_scalar<uint32_t>(out, session_version);
+      umap_->save(out);
+      knncolle::write_scalar<int32_t>(out, searcher_ ? nn_method_ : NN_NONE);
+      umappp_save_index_parameters(out, index_params_);
+      knncolle::write_scalar<int32_t>(out, nd);
+      knncolle::write_scalar<int32_t>(out, nobs);
+      knncolle::write_scalar<int32_t>(out, ndim);
+      out.write(reinterpret_cast<const char *>(status_->embedding()), sizeof(Float) * static_cast<size_t>(nobs) * ndim);
+      status_->save(out);
+
+      if (!searcher_)
+      {
+        // Nothing to write.
+      }
+      else if (nn_method_ == NN_ANNOY)
+      {
+        static_cast<knncolle::AnnoyEuclidean<int, Float> *>(searcher_.get())->save(index_sidecar(path, nn_method_));
+      }
+      else if (nn_method_ == NN_HNSW)
+      {
+        static_cast<knncolle::HnswEuclidean<int, Float> *>(searcher_.get())->save(index_sidecar(path, nn_method_));
+      }
+      else
+      {
+        save_index(out);
+      }
+
+      out.close();
+      if (!out)
+      {
+        throw std::runtime_error("failed to write " + path);
+      }
+    });
+  }
+
+  Hash thread_statistics() const
+  {
+    Busy busy(busy_);
+    const auto &stats = status_->thread_statistics();
+    Hash h;
+    h[Symbol("work_time")] = stats.work_time;
+    h[Symbol("spin_time")] = stats.spin_time;
+    h[Symbol("park_time")] = stats.park_time;
+    h[Symbol("num_parks")] = stats.num_parks;
+    return h;
+  }
+
+  VALUE embedding_value() const
+  {
+    return embedding_;
+  }
+
+private:
+  // Set while a method runs without the GVL. The GVL is held whenever the
+  // flag is tested or set, so another Ruby thread that calls a method of the
+  // same session in the meantime gets an error instead of a data race.
+  class Busy
+  {
+  public:
+    Busy(bool &flag) : flag_(flag)
+    {
+      if (flag_)
+      {
+        throw std::runtime_error("session is busy");
+      }
+      flag_ = true;
+    }
+
+    ~Busy()
+    {
+      flag_ = false;
+    }
+
+  private:
+    bool &flag_;
+  };
+
+  template <typename Input>
+  void initialize(Umap &umap, const Input *y, size_t *shape, int ndim, int nn_method)
+  {
+    int nd = shape[1];
+    int nobs = shape[0];
+    if (nobs < 0)
+    {
+      throw std::runtime_error("nobs is negative");
+    }
+
+    // it is safe to cast to unsigned int
+    auto na = numo::SFloat({(unsigned int)nobs, (unsigned int)ndim});
+    Float *embedding = na.write_ptr();
+    embedding_ = na.value();
+
+    // Everything below only touches C++ memory, so the GVL is released.
+    // The input array stays referenced by the caller until we return.
+    // The neighbor search and initialization cannot be cut short,
+    // but pending interrupts are serviced as soon as they finish.
+    without_gvl([&](const std::atomic<bool> &) {
+      auto knncolle_ptr = build_index(nn_method, nd, nobs, y);
+
+      status_.reset(new Umap::Status(umap.initialize(knncolle_ptr.get(), ndim, embedding)));
+      epoch_.store(status_->epoch());
+
+      // Kept for transform() and save(); the index holds its own copy of the data.
+      searcher_ = std::move(knncolle_ptr);
+      nn_method_ = nn_method;
+    });
+  }
+
+  template <typename Input>
+  std::unique_ptr<knncolle::Base<int, Float>> build_index(int nn_method, int nd, int nobs, const Input *y) const
+  {
+    const auto &p = index_params_;
+    std::unique_ptr<knncolle::Base<int, Float>> knncolle_ptr;
+    if (nn_method == NN_ANNOY)
+    {
+      knncolle_ptr.reset(new knncolle::AnnoyEuclidean<int, Float>(nd, nobs, y, p.ntrees, p.search_mult, p.num_threads));
+    }
+    else if (nn_method == NN_VPTREE && p.single_precision)
+    {
+      knncolle_ptr.reset(new knncolle::VpTreeEuclidean<int, Float, Float, Float, Float>(nd, nobs, y, p.bucket_size, p.num_threads));
+    }
+    else if (nn_method == NN_VPTREE)
+    {
+      knncolle_ptr.reset(new knncolle::VpTreeEuclidean<int, Float>(nd, nobs, y, p.bucket_size, p.num_threads));
+    }
+    else if (nn_method == NN_KMKNN)
+    {
+      knncolle_ptr.reset(new knncolle::KmknnEuclidean<int, Float>(nd, nobs, y, p.power, p.num_threads));
+    }
+    else if (nn_method == NN_HNSW)
+    {
+      knncolle_ptr.reset(new knncolle::HnswEuclidean<int, Float>(nd, nobs, y, p.nlinks, p.ef_construction, p.ef_search, p.num_threads, p.deterministic_build));
+    }
+    else if (nn_method == NN_BRUTE_FORCE && p.single_precision)
+    {
+      knncolle_ptr.reset(new knncolle::BruteForceEuclidean<int, Float, Float, Float, Float>(nd, nobs, y));
+    }
+    else if (nn_method == NN_BRUTE_FORCE)
+    {
+      knncolle_ptr.reset(new knncolle::BruteForceEuclidean<int, Float>(nd, nobs, y));
+    }
+    else if (nn_method == NN_GEMM && p.single_precision)
+    {
+      knncolle_ptr.reset(new knncolle::Gemm<int, Float, Float, Float>(nd, nobs, y, p.max_block_memory));
+    }
+    else if (nn_method == NN_GEMM)
+    {
+      knncolle_ptr.reset(new knncolle::Gemm<int, Float>(nd, nobs, y, p.max_block_memory));
+    }
+    else
+    {
+      throw std::runtime_error("unknown nearest neighbor method");
+    }
+    return knncolle_ptr;
+  }
+
+  // Read an index that is saved inline, i.e., any but Annoy and HNSW, of
+  // the type that build_index() would create.
+  std::unique_ptr<knncolle::Base<int, Float>> load_index(std::istream &in, int nn_method) const
+  {
+    const auto &p = index_params_;
+    std::unique_ptr<knncolle::Base<int, Float>> knncolle_ptr;
+    if (nn_method == NN_VPTREE && p.single_precision)
+    {
+      knncolle_ptr.reset(new knncolle::VpTreeEuclidean<int, Float, Float, Float, Float>(in));
+    }
+    else if (nn_method == NN_VPTREE)
+    {
+      knncolle_ptr.reset(new knncolle::VpTreeEuclidean<int, Float>(in));
+    }
+    else if (nn_method == NN_KMKNN)
+    {
+      knncolle_ptr.reset(new knncolle::KmknnEuclidean<int, Float>(in));
+    }
+    else if (nn_method == NN_BRUTE_FORCE && p.single_precision)
+    {
+      knncolle_ptr.reset(new knncolle::BruteForceEuclidean<int, Float, Float, Float, Float>(in));
+    }
+    else if (nn_method == NN_BRUTE_FORCE)
+    {
+      knncolle_ptr.reset(new knncolle::BruteForceEuclidean<int, Float>(in));
+    }
+    else if (nn_method == NN_GEMM && p.single_precision)
+    {
+      knncolle_ptr.reset(new knncolle::Gemm<int, Float, Float, Float>(in, p.max_block_memory));
+    }
+    else if (nn_method == NN_GEMM)
+    {
+      knncolle_ptr.reset(new knncolle::Gemm<int, Float>(in, p.max_block_memory));
+    }
+    else
+    {
+      throw std::runtime_error("unknown nearest neighbor method");
+    }
+    return knncolle_ptr;
+  }
+
+  // Write searcher_ inline, to be read by load_index().
+  void save_index(std::ostream &out) const
+  {
+    const auto &p = index_params_;
+    auto searcher = searcher_.get();
+    if (nn_method_ == NN_VPTREE && p.single_precision)
+    {
+      static_cast<const knncolle::VpTreeEuclidean<int, Float, Float, Float, Float> *>(searcher)->save(out);
+    }
+    else if (nn_method_ == NN_VPTREE)
+    {
+      static_cast<const knncolle::VpTreeEuclidean<int, Float> *>(searcher)->save(out);
+    }
+    else if (nn_method_ == NN_KMKNN)
+    {
+      static_cast<const knncolle::KmknnEuclidean<int, Float> *>(searcher)->save(out);
+    }
+    else if (nn_method_ == NN_BRUTE_FORCE && p.single_precision)
+    {
+      static_cast<const knncolle::BruteForceEuclidean<int, Float, Float, Float, Float> *>(searcher)->save(out);
+    }
+    else if (nn_method_ == NN_BRUTE_FORCE)
+    {
+      static_cast<const knncolle::BruteForceEuclidean<int, Float> *>(searcher)->save(out);
+    }
+    else if (nn_method_ == NN_GEMM && p.single_precision)
+    {
+      static_cast<const knncolle::Gemm<int, Float, Float, Float> *>(searcher)->save(out);
+    }
+    else if (nn_method_ == NN_GEMM)
+    {
+      static_cast<const knncolle::Gemm<int, Float> *>(searcher)->save(out);
+    }
+    else
+    {
+      throw std::runtime_error("unknown nearest neighbor method");
+    }
+  }
+
+private:
+  VALUE embedding_;
+  std::unique_ptr<Umap::Status> status_;
+  std::unique_ptr<Umap> umap_;
+  std::unique_ptr<knncolle::Base<int, Float>> searcher_;
+  int nn_method_ = NN_NONE;
+  IndexParameters index_params_;
+  mutable bool busy_ = false;
+  // Copy of status_->epoch(), published after each call to Status::run.
+  std::atomic<int> epoch_{0};
+};
+
+namespace Rice
+{
+  template <>
+  void ruby_mark(UmapSession *session)
+  {
+    rb_gc_mark(session->embedding_value());
+  }
+}
+
+// Function to perform umap.
+
+Object umappp_run(
+    Object self,
+    Hash params,
+    Object data,
+    int ndim,
+    int nn_method)
+{
+  UmapSession session(params, data, ndim, nn_method);
+  return session.run();
+}
+
+// Function to perform umap from precomputed nearest neighbors.
+
+Object umappp_run_with_neighbors(
+    Object self,
+    Hash params,
+    numo::Int32 indices,
+    numo::SFloat distances,
+    int ndim)
+{
+  UmapSession session(params, indices, distances, ndim);
+  return session.run();
+}
+
+// Function to restore a session written by UmapSession::save.
+
+UmapSession *umappp_load(Object self, std::string path, Hash params)
+{
+  return new UmapSession(path, params);
 }
 
 extern "C" void Init_umappp()
@@ -208,11 +1201,33 @@ extern "C" void Init_umappp()
   Module rb_mUmappp =
       define_module("Umappp")
           .define_singleton_method("umappp_run", &umappp_run)
-          .define_singleton_method("umappp_default_parameters", &umappp_default_parameters);
+          .define_singleton_method("umappp_run_with_neighbors", &umappp_run_with_neighbors)
+          .define_singleton_method("umappp_default_parameters", &umappp_default_parameters)
+          .define_singleton_method("umappp_simd_level", &umappp_simd_level)
+          .define_singleton_method("umappp_supported_simd_level", &umappp_supported_simd_level)
+          .define_singleton_method("umappp_set_simd_level", &umappp_set_simd_level);
+#ifdef UMAPPP_TEST_HOOKS
+  rb_mUmappp.define_singleton_method("umappp_squared_distances", &umappp_squared_distances)
+      .define_singleton_method("umappp_neighbor_similarities", &umappp_neighbor_similarities);
+#endif
   Enum<umappp::InitMethod> init_method =
       define_enum<umappp::InitMethod>("InitMethod", rb_mUmappp)
           .define_value("SPECTRAL", umappp::InitMethod::SPECTRAL)
           .define_value("SPECTRAL_ONLY", umappp::InitMethod::SPECTRAL_ONLY)
           .define_value("RANDOM", umappp::InitMethod::RANDOM)
           .define_value("NONE", umappp::InitMethod::NONE);
+  Data_Type<UmapSession> rb_cSession =
+      define_class_under<UmapSession>(rb_mUmappp, "Session")
+          .define_constructor(Constructor<UmapSession, Hash, Object, int, int>())
+          .define_method("epoch", &UmapSession::epoch)
+          .define_method("num_epochs", &UmapSession::num_epochs)
+          .define_method("finished?", &UmapSession::is_finished)
+          .define_method("step", &UmapSession::step, Arg("epochs") = 1)
+          .define_method("run", &UmapSession::run)
+          .define_method("embedding", &UmapSession::embedding)
+          .define_method("umappp_transform", &UmapSession::transform)
+          .define_method("umappp_save", &UmapSession::save)
+          .define_method("thread_statistics", &UmapSession::thread_statistics);
+  // Defined after Session so that Rice knows the return type.
+  rb_mUmappp.define_singleton_method("umappp_load", &umappp_load, Return().takeOwnership());
 }
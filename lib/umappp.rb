@@ -8,7 +8,21 @@ require_relative "umappp/umappp"
 module Umappp
   # Make wrapper methods for the C++ function generated by Rice private
   private_class_method :umappp_run
+  private_class_method :umappp_run_with_neighbors
+  private_class_method :umappp_load
   private_class_method :umappp_default_parameters
+  private_class_method :umappp_simd_level
+  private_class_method :umappp_supported_simd_level
+  private_class_method :umappp_set_simd_level
+  # Only defined when the extension is built with --enable-test-hooks.
+  private_class_method :umappp_squared_distances if respond_to?(:umappp_squared_distances)
+  private_class_method :umappp_neighbor_similarities if respond_to?(:umappp_neighbor_similarities)
+
+  # Nearest neighbor search methods, in the order expected by the C++ code.
+  NN_METHODS = %i[annoy vptree kmknn hnsw brute_force gemm].freeze
+
+  # Instruction sets for the SIMD kernels, in the order expected by the C++ code.
+  SIMD_LEVELS = %i[none sse2 avx2 avx512].freeze
 
   # View the default parameters defined within the Umappp C++ library structure.
   def self.default_parameters
@@ -16,10 +30,34 @@ module Umappp
     umappp_default_parameters
   end
 
+  # The instruction set used by the SIMD kernels for distance calculations.
+  # By default, this is the best one supported by the CPU.
+  # @return [Symbol] one of {SIMD_LEVELS}
+  def self.simd_level
+    SIMD_LEVELS[umappp_simd_level]
+  end
+
+  # Changes the instruction set of the SIMD kernels for all later calls in
+  # this process. The terms of the distances are added up in a different
+  # order by each instruction set, so the results can differ slightly;
+  # :none gives the same results on every machine.
+  # @param level [Symbol] one of {simd_levels}
+  def self.simd_level=(level)
+    index = SIMD_LEVELS.index(level.to_sym)
+    raise ArgumentError, "SIMD level must be one of #{SIMD_LEVELS.map(&:inspect).join(", ")}" if index.nil?
+
+    umappp_set_simd_level(index)
+  end
+
+  # @return [Array<Symbol>] the instruction sets that can be used on this CPU
+  def self.simd_levels
+    SIMD_LEVELS[0..umappp_supported_simd_level]
+  end
+
   # Runs the Uniform Manifold Approximation and Projection (UMAP) dimensional
   # reduction technique.
-  # @param embedding [Array, Numo::SFloat]
-  # @param method [Symbol]
+  # @param embedding [Array, Numo::SFloat, Numo::DFloat]
+  # @param method [Symbol] :annoy, :vptree, :kmknn, :hnsw, :brute_force or :gemm
   # @param ndim [Integer]
   # @param tick [Integer]
   # @param local_connectivity [Numeric]
@@ -37,20 +75,154 @@ module Umappp
   # @param num_neighbors [Integer]
   # @param seed [Integer]
   # @param num_threads [Integer]
-  # @param parallel_optimization [Boolean]
+  # @param parallel_optimization [Boolean, Symbol] true, or :async for lock-free (non-reproducible) updates
+  # @param spin_budget [Integer] spins before an idle optimizer thread parks; negative spins forever
+  # @param num_similarity_threads [Integer] threads for the fuzzy set calculation; 0 uses num_threads
+  # @param newton_calibration [Boolean] use Newton steps to find the fuzzy set bandwidths
+  # @param ntrees [Integer] number of Annoy trees
+  # @param search_mult [Numeric] Annoy nodes searched per neighbor; -1 uses ntrees
+  # @param nlinks [Integer] HNSW links per node (M in hnswlib)
+  # @param ef_construction [Integer] HNSW candidate list size when building
+  # @param ef_search [Integer] HNSW candidate list size when searching
+  # @param deterministic_build [Boolean] insert HNSW points serially, so the
+  #   index does not depend on num_threads
+  # @param power [Numeric] Kmknn uses nobs**power cluster centers
+  # @param bucket_size [Integer] maximum number of points in a VP tree leaf
+  # @param single_precision [Boolean] store the data of a VP tree, brute-force
+  #   or GEMM index as floats and compute its distances in single precision
+  # @param max_block_memory [Integer] bytes for the block of distances that
+  #   each thread of a GEMM search computes at once, at least 4
   # @return [Numo::SFloat] the final embedding
 
   def self.run(embedding, method: :annoy, ndim: 2, **params)
-    unless (u = (params.keys - default_parameters.keys)).empty?
-      raise ArgumentError, "[umappp.rb] unknown option : #{u.inspect}"
-    end
+    umappp_run(*validate_arguments(embedding, method, ndim, params))
+  end
+
+  # Runs UMAP on precomputed nearest neighbors instead of searching for them.
+  # Row i of both matrices describes the neighbors of observation i, ordered
+  # by increasing distance. Negative indices and i itself are ignored, so the
+  # output of FAISS can be passed as it is.
+  # @param indices [Array, Numo::Int32] n x k matrix of neighbor indices
+  # @param distances [Array, Numo::SFloat] n x k matrix of neighbor distances
+  # @param ndim [Integer]
+  # @param params [Hash] the same parameters as {Umappp.run}; num_neighbors is ignored
+  # @return [Numo::SFloat] the final embedding
+
+  def self.run_with_neighbors(indices, distances, ndim: 2, **params)
+    validate_parameters(params)
+
+    indices2 = Numo::Int32.cast(indices)
+    distances2 = Numo::SFloat.cast(distances)
+    raise ArgumentError, "indices and distances must be 2D arrays" if indices2.ndim != 2 || distances2.ndim != 2
+    raise ArgumentError, "indices and distances must have the same shape" if indices2.shape != distances2.shape
+
+    umappp_run_with_neighbors(params, indices2, distances2, ndim)
+  end
 
-    nnmethod = %i[annoy vptree].index(method.to_sym)
-    raise ArgumentError, "method must be :annoy or :vptree" if nnmethod.nil?
+  # Prepares a UMAP run that can be advanced a few epochs at a time.
+  # The nearest neighbor search and initialization are done here; the
+  # layout optimization is done by {Session#step} or {Session#run}.
+  # Takes the same arguments as {Umappp.run}.
+  # @return [Umappp::Session]
 
-    embedding2 = Numo::SFloat.cast(embedding)
+  def self.session(embedding, method: :annoy, ndim: 2, **params)
+    Session.send(:new, *validate_arguments(embedding, method, ndim, params))
+  end
+
+  # Restores a session written by {Session#save}, without redoing the
+  # nearest neighbor search or the optimization. Annoy and HNSW indices are
+  # read from the `path + ".annoy"` or `path + ".hnsw"` file next to `path`,
+  # which must be kept; Annoy's is memory-mapped.
+  # @param path [String] file written by {Session#save}
+  # @param params [Hash] parameters overriding the saved ones, e.g. num_threads;
+  #   those that only affect how the index is built, such as bucket_size or
+  #   single_precision, are ignored, as the saved index is used as it is
+  # @return [Umappp::Session]
+
+  def self.load(path, **params)
+    validate_parameters(params)
+    umappp_load(path.to_s, params)
+  end
+
+  def self.validate_parameters(params)
+    return if (u = (params.keys - default_parameters.keys)).empty?
+
+    raise ArgumentError, "[umappp.rb] unknown option : #{u.inspect}"
+  end
+  private_class_method :validate_parameters
+
+  def self.validate_arguments(embedding, method, ndim, params)
+    validate_parameters(params)
+
+    nnmethod = NN_METHODS.index(method.to_sym)
+    raise ArgumentError, "method must be one of #{NN_METHODS.map(&:inspect).join(", ")}" if nnmethod.nil?
+
+    # SFloat and DFloat are passed through as they are to avoid a copy.
+    embedding2 = case embedding
+                 when Numo::SFloat, Numo::DFloat then embedding
+                 else Numo::SFloat.cast(embedding)
+                 end
     raise ArgumentError, "embedding must be a 2D array" if embedding2.ndim <= 1
 
-    umappp_run(params, embedding2, ndim, nnmethod)
+    [params, embedding2, ndim, nnmethod]
+  end
+  private_class_method :validate_arguments
+
+  # A UMAP optimization in progress, created by {Umappp.session}.
+  #
+  #   session = Umappp.session(data)
+  #   session.step(10) until session.finished?
+  #
+  # @!method epoch
+  #   @return [Integer] the number of epochs run so far
+  # @!method num_epochs
+  #   @return [Integer] the total number of epochs
+  # @!method finished?
+  #   @return [Boolean] whether all epochs have been run
+  # @!method step(epochs = 1)
+  #   Runs more epochs, stopping at the total number of epochs.
+  #   @param epochs [Integer]
+  #   @return [Integer] the current epoch
+  # @!method run
+  #   Runs all remaining epochs.
+  #   @return [Numo::SFloat] the final embedding
+  # @!method embedding
+  #   The current embedding. This is the array updated by the optimizer,
+  #   not a copy, so it changes as the session advances.
+  #   @return [Numo::SFloat]
+  # @!method thread_statistics
+  #   Seconds spent working, spinning and parked by the threads of
+  #   parallel_optimization: true, and the number of times threads parked.
+  #   @return [Hash]
+  class Session
+    private_class_method :new
+    private :umappp_transform, :umappp_save
+
+    # Places new observations into the current embedding, using the
+    # nearest neighbor index built from the training data. The session's
+    # own embedding is not modified.
+    # @param data [Numo::SFloat] new observations, with the same number of
+    #   columns as the training data
+    # @param num_epochs [Integer] optimization epochs for the new points;
+    #   defaults to a third of the training epochs
+    # @return [Numo::SFloat] the embedding of the new observations
+    def transform(data, num_epochs: nil)
+      data = Numo::SFloat.cast(data)
+      raise ArgumentError, "data must be a 2D array" unless data.ndim == 2
+
+      umappp_transform(data, num_epochs || -1)
+    end
+
+    # Writes the session, including its nearest neighbor index, fuzzy graph
+    # and optimizer state, so that {Umappp.load} can restore it in another
+    # process. Annoy and HNSW indices are written to `path + ".annoy"` and
+    # `path + ".hnsw"` respectively.
+    # Files are in native byte order and tied to this version of umappp.
+    # @param path [String]
+    # @return [Umappp::Session] self
+    def save(path)
+      umappp_save(path.to_s)
+      self
+    end
   end
 end
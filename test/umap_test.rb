@@ -20,6 +20,290 @@ class UmapppTest < Test::Unit::TestCase
     assert_equal [10, 2], r.shape
   end
 
+  test "run with DFloat" do
+    embedding = Numo::DFloat.new(50, 10).rand
+    r = Umappp.run(embedding)
+    assert_instance_of Numo::SFloat, r
+    assert_equal Umappp.run(Numo::SFloat.cast(embedding)), r
+  end
+
+  test "run in multiple threads" do
+    embedding = Numo::SFloat.new(50, 10).rand
+    expected = Umappp.run(embedding)
+    threads = Array.new(3) { Thread.new { Umappp.run(embedding) } }
+    threads.each do |t|
+      assert_equal expected, t.value
+    end
+  end
+
+  test "asynchronous parallel optimization" do
+    embedding = Numo::SFloat.new(50, 10).rand
+    r = Umappp.run(embedding, num_threads: 2, parallel_optimization: :async)
+    assert_equal [50, 2], r.shape
+    assert r.isfinite.all?
+  end
+
+  test "newton calibration" do
+    embedding = Numo::SFloat.new(50, 10).rand
+    r = Umappp.run(embedding, newton_calibration: true)
+    assert_equal [50, 2], r.shape
+    assert r.isfinite.all?
+  end
+
+  test "nearest neighbor methods" do
+    embedding = Numo::SFloat.new(50, 10).rand
+    Umappp::NN_METHODS.each do |method|
+      r = Umappp.run(embedding, method: method, num_epochs: 20)
+      assert_equal [50, 2], r.shape
+      assert r.isfinite.all?
+    end
+    r = Umappp.run(Numo::DFloat.cast(embedding), method: :vptree, num_epochs: 20)
+    assert_equal [50, 2], r.shape
+  end
+
+  test "nearest neighbor parameters" do
+    embedding = Numo::SFloat.new(50, 10).rand
+    r = Umappp.run(embedding, method: :hnsw, nlinks: 8, ef_construction: 50, ef_search: 30)
+    assert_equal [50, 2], r.shape
+    r = Umappp.run(embedding, method: :hnsw, num_threads: 2, deterministic_build: true)
+    assert_equal Umappp.run(embedding, method: :hnsw), r
+    r = Umappp.run(embedding, method: :kmknn, power: 0.3)
+    assert_equal [50, 2], r.shape
+    assert_equal r, Umappp.run(embedding, method: :kmknn, power: 0.3, num_threads: 2)
+    r = Umappp.run(embedding, method: :vptree, bucket_size: 1)
+    assert_equal Umappp.run(embedding, method: :vptree, bucket_size: 64), r
+    assert_equal r, Umappp.run(embedding, method: :vptree, bucket_size: 4, num_threads: 2)
+    assert_equal Umappp.run(embedding, method: :brute_force), Umappp.run(embedding, method: :gemm, max_block_memory: 1000)
+    %i[vptree brute_force gemm].each do |method|
+      r = Umappp.run(embedding, method: method, single_precision: true)
+      assert_equal [50, 2], r.shape
+      assert r.isfinite.all?
+    end
+  end
+
+  test "simd distance kernels" do
+    default = Umappp.simd_level
+    assert_include Umappp.simd_levels, default
+    assert_raise(ArgumentError) do
+      Umappp.simd_level = :foo
+    end
+    omit_unless Umappp.respond_to?(:umappp_squared_distances, true), "built without --enable-test-hooks"
+
+    [1, 3, 4, 7, 8, 9, 15, 16, 17, 31, 33, 64, 100].each do |ncol|
+      x = Numo::SFloat.new(50, ncol).rand_norm
+      y = Numo::SFloat.new(50, ncol).rand_norm
+      Umappp.simd_level = :none
+      expected = [Umappp.send(:umappp_squared_distances, x, y, false),
+                  Umappp.send(:umappp_squared_distances, x, y, true),
+                  Umappp.send(:umappp_squared_distances, Numo::DFloat.cast(x), Numo::DFloat.cast(y), false)]
+      Umappp.simd_levels.each do |level|
+        Umappp.simd_level = level
+        assert_equal level, Umappp.simd_level
+        d = Umappp.send(:umappp_squared_distances, x, y, false)
+        assert_true (d - expected[0]).abs.le(expected[0] * 1e-12).all?, "#{level}, #{ncol} columns"
+        d = Umappp.send(:umappp_squared_distances, x, y, true)
+        assert_true (d - expected[1]).abs.le(expected[1] * 1e-5).all?, "#{level}, #{ncol} columns, single precision"
+        d = Umappp.send(:umappp_squared_distances, Numo::DFloat.cast(x), Numo::DFloat.cast(y), false)
+        assert_true (d - expected[2]).abs.le(expected[2] * 1e-12).all?, "#{level}, #{ncol} columns, double input"
+      end
+    end
+  ensure
+    Umappp.simd_level = default
+  end
+
+  test "newton calibration matches bisection" do
+    default = Umappp.simd_level
+    omit_unless Umappp.respond_to?(:umappp_neighbor_similarities, true), "built without --enable-test-hooks"
+
+    tol = 1e-5
+    [5, 16, 40].each do |k|
+      distances = Numo::SFloat.new(100, k).rand(0.1, 3).sort(axis: 1)
+      target = Math.log2(k + 1)
+      reference = Umappp.send(:umappp_neighbor_similarities, Numo::DFloat.cast(distances), false)
+      assert_true (reference.sum(axis: 1) - target).abs.lt(tol).all?
+      r = Umappp.send(:umappp_neighbor_similarities, Numo::DFloat.cast(distances), true)
+      assert_true (r.sum(axis: 1) - target).abs.lt(tol).all?, "#{k} neighbors, double precision"
+      Umappp.simd_levels.each do |level|
+        Umappp.simd_level = level
+        [false, true].each do |newton|
+          r = Umappp.send(:umappp_neighbor_similarities, distances, newton)
+          message = "#{level}, #{k} neighbors, newton: #{newton}"
+          # Single precision adds its own rounding error to the tolerance.
+          assert_true (r.sum(axis: 1) - target).abs.lt(2 * tol).all?, message
+          assert_true (r - reference).abs.lt(tol).all?, message
+        end
+      end
+    end
+  ensure
+    Umappp.simd_level = default
+  end
+
+  test "annoy parameters" do
+    embedding = Numo::SFloat.new(50, 10).rand
+    r = Umappp.run(embedding, ntrees: 5, search_mult: 2, num_threads: 2)
+    assert_equal [50, 2], r.shape
+    assert_equal r, Umappp.run(embedding, ntrees: 5, search_mult: 2, num_threads: 2)
+  end
+
+  test "session" do
+    embedding = Numo::SFloat.new(50, 10).rand
+    session = Umappp.session(embedding, num_epochs: 20)
+    assert_instance_of Umappp::Session, session
+    assert_equal 0, session.epoch
+    assert_equal 20, session.num_epochs
+    view = session.embedding
+    assert_equal [50, 2], view.shape
+    before = view.dup
+    assert_equal 5, session.step(5)
+    assert_not_equal before, session.embedding
+    assert_equal 20, session.step(100)
+    assert_true session.finished?
+    assert_equal Umappp.run(embedding, num_epochs: 20), view
+  end
+
+  test "session stepped from several threads" do
+    embedding = Numo::SFloat.new(200, 10).rand
+    session = Umappp.session(embedding, num_epochs: 100)
+    errors = Queue.new
+    threads = Array.new(2) do
+      Thread.new do
+        25.times { session.step(2) }
+      rescue RuntimeError => e
+        errors << e
+      end
+    end
+    threads.each(&:join)
+    errors.size.times do
+      assert_equal "session is busy", errors.pop.message
+    end
+    session.run
+    assert_equal Umappp.run(embedding, num_epochs: 100), session.embedding
+  end
+
+  test "session progress polled from another thread" do
+    embedding = Numo::SFloat.new(200, 10).rand
+    session = Umappp.session(embedding, num_epochs: 200)
+    worker = Thread.new { 20.times { session.step(10) } }
+    seen = []
+    assert_nothing_raised do
+      until worker.join(0.001)
+        seen << session.epoch
+        session.finished?
+      end
+    end
+    assert_equal seen.sort, seen
+    assert_equal 200, session.epoch
+    assert_true session.finished?
+  end
+
+  test "session thread statistics" do
+    embedding = Numo::SFloat.new(50, 10).rand
+    session = Umappp.session(embedding, num_epochs: 5, num_threads: 2, parallel_optimization: true, spin_budget: 0)
+    session.run
+    stats = session.thread_statistics
+    assert_equal %i[work_time spin_time park_time num_parks], stats.keys
+    assert stats[:work_time].positive?
+  end
+
+  test "session transform" do
+    data = Numo::SFloat.new(60, 5).rand
+    session = Umappp.session(data[0...50, true], num_epochs: 30)
+    session.run
+    before = session.embedding.dup
+    r = session.transform(data[50..-1, true])
+    assert_instance_of Numo::SFloat, r
+    assert_equal [10, 2], r.shape
+    assert r.isfinite.all?
+    assert_equal before, session.embedding
+    assert_equal r, session.transform(data[50..-1, true])
+
+    assert_raise(RuntimeError) do
+      session.transform(Numo::SFloat.new(3, 4).rand)
+    end
+  end
+
+  test "session save and load" do
+    require "tmpdir"
+    data = Numo::SFloat.new(60, 5).rand
+    Umappp::NN_METHODS.each do |method|
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "model.bin")
+        session = Umappp.session(data[0...50, true], method: method, num_epochs: 20)
+        session.step(10)
+        session.save(path)
+        session.run
+
+        loaded = Umappp.load(path)
+        assert_equal 10, loaded.epoch
+        assert_equal session.run, loaded.run
+        assert_equal session.transform(data[50..-1, true]), loaded.transform(data[50..-1, true])
+      end
+    end
+
+    [{ method: :vptree, bucket_size: 2 }, { method: :gemm, max_block_memory: 1000 }].each do |params|
+      [false, true].each do |single_precision|
+        Dir.mktmpdir do |dir|
+          path = File.join(dir, "model.bin")
+          session = Umappp.session(data[0...50, true], single_precision: single_precision, num_epochs: 20, **params)
+          session.run
+          session.save(path)
+          assert_equal session.transform(data[50..-1, true]), Umappp.load(path).transform(data[50..-1, true])
+          # The saved index is used as it is, whatever the parameters given to load.
+          assert_equal session.transform(data[50..-1, true]),
+                       Umappp.load(path, single_precision: !single_precision, bucket_size: 16).transform(data[50..-1, true])
+        end
+      end
+    end
+
+    assert_raise(RuntimeError) do
+      Umappp.load(__FILE__)
+    end
+  end
+
+  test "run with neighbors" do
+    # All differences between these coordinates are distinct, so the
+    # distances are exact and no two neighbors of a point are tied.
+    coords = [0]
+    differences = {}
+    candidate = 0
+    while coords.size < 30
+      candidate += 1
+      next if coords.any? { |c| differences[candidate - c] }
+
+      coords.each { |c| differences[candidate - c] = true }
+      coords << candidate
+    end
+    data = Numo::SFloat.zeros(30, 3)
+    data[true, 1] = coords.shuffle
+    k = 5
+
+    indices = Numo::Int32.zeros(30, k)
+    distances = Numo::SFloat.zeros(30, k)
+    30.times do |i|
+      d = (data[true, 1] - data[i, 1]).abs
+      order = d.sort_index.to_a.reject { |j| j == i }[0...k]
+      indices[i, true] = order
+      distances[i, true] = d[order]
+    end
+    expected = Umappp.run(data, method: :brute_force, num_neighbors: k)
+    r = Umappp.run_with_neighbors(indices, distances)
+    assert_instance_of Numo::SFloat, r
+    assert_equal expected, r
+
+    # The point itself and negative indices, e.g., FAISS's padding, are skipped.
+    padded_indices = Numo::Int32.new(30, k + 3).fill(-1)
+    padded_distances = Numo::SFloat.zeros(30, k + 3)
+    padded_indices[true, 0] = Numo::Int32.new(30).seq
+    padded_indices[true, 1..k] = indices
+    padded_distances[true, 1..k] = distances
+    padded_distances[true, -1] = 1e6
+    assert_equal expected, Umappp.run_with_neighbors(padded_indices, padded_distances)
+
+    assert_raise(ArgumentError) do
+      Umappp.run_with_neighbors(indices, distances[true, 0...4])
+    end
+  end
+
   test "one dimensional embedding" do
     embedding = Numo::SFloat.new(10).rand
     assert_raise(ArgumentError) do
@@ -47,4 +331,13 @@ class UmapppTest < Test::Unit::TestCase
       Umappp.run(embedding, ndim: -1)
     end
   end
+
+  test "invalid max_block_memory" do
+    embedding = Numo::SFloat.new(10, 10).rand
+    [-1, 0, 3].each do |max_block_memory|
+      assert_raise(RuntimeError) do
+        Umappp.run(embedding, method: :gemm, max_block_memory: max_block_memory)
+      end
+    end
+  end
 end